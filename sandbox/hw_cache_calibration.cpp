@@ -0,0 +1,236 @@
+#include <compiling.h>
+#include <hw_cache.hpp>
+#include <resources.hpp>
+#include <stream_utils.h>
+#include <timing.hpp>
+#include <algorithm> // IWYU keep
+#include <map>
+#include <random>
+
+using namespace std;
+
+/*
+ CALIBRATION
+ - pages sharing physical address bits [page bits, page bits + k) form a group
+ - pointer chase over all cache lines of n pages of a group is fast while n pages fit the sets they map to
+   and slows down once L2 spills, first such n is the knee
+ - k < color bits: group spreads over 2^(c-k) colors, knee = ways * 2^(c-k) + 1
+ - k >= color bits: all pages have same color, knee = ways + 1
+   so color bits is the smallest k after which knee stops halving and ways = knee - 1
+ - fixing every bit of the window but b: knee doubles if b selects the set, it is kept otherwise
+ - every knee is a median of few sweeps, a noisy sweep finds a knee early, so sweeps finding one below
+   the knee of the fully fixed window (ways + 1) are dropped
+ */
+
+template<typename _T>
+struct CalibrateL2 {
+    using T = IDE_DEFAULT_TYPE(_T, M1);
+    using M = T::Memory;
+    using C = PageColors<T, typename T::L2>;
+    using L = T::L2;
+    using vaddr_t = uint8_t*;
+    using page_indices_t = vector<size_t>;
+    constexpr static size_t straddle = M::Page::size / PAGE_SIZE;
+    constexpr static size_t lines = M::Page::size / M::CacheLine::size;
+    constexpr static size_t window_bits = C::c_bits + 2; // physical bits above page offset under test
+    constexpr static size_t population = (1ul << window_bits) * (L::ways + 4);
+    constexpr static size_t chase_loads = 1 << 18;
+    constexpr static double spill_ratio = 1.5;
+    constexpr static size_t sweeps = 5;
+    static_assert(M::Page::size % PAGE_SIZE == 0);
+
+    vaddr_t base;
+    vector<PageMapEntry> base_map;
+    double l2_hit_ns = 0;
+    size_t plateau = 0;         // knee of the fully fixed window, ways + 1
+    vector<size_t> knees;       // knee by count of fixed low bits
+    size_t colors_bits = 0, ways = 0;
+    vector<size_t> index_bits;  // physical address bits found to select L2 set
+    mt19937_64 rnd { 42 };
+
+    void allocate() {
+        size_t size = M::Page::size * population;
+        void *raw;
+        SYS_CALL_MMAP(raw = mmap(0, size + M::Page::size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0), "mmap");
+        base = (vaddr_t) align_up(raw, M::Page::size);
+        memset(base, 0, size);
+        cout << "base virtual address " << (void*) base << ", size " << size << endl;
+        base_map.resize(population);
+        get_physical_pages(base, &base_map[0], population, straddle);
+        CHECK(base_map[0].ptr(), "no PFN in pagemap, it requires CAP_SYS_ADMIN");
+    }
+
+    uint64_t physical(size_t idx) const {
+        return uint64_t(base_map[idx].ptr());
+    }
+
+    // pages which agree on masked physical bits with the most populated value
+    page_indices_t largest_group(uint64_t mask) const {
+        map<uint64_t, page_indices_t> groups;
+        for (size_t i = 0; i < population; ++i)
+            groups[physical(i) & mask].push_back(i);
+        return max_element(groups.begin(), groups.end(), [](const auto &g1, const auto &g2) {
+            return g1.second.size() < g2.second.size();
+        })->second;
+    }
+
+    static uint64_t window_mask(size_t bits) {
+        return ((1ul << bits) - 1) << M::Page::bits;
+    }
+
+    // ns per load of random pointer chase over every cache line of given pages, best of few attempts
+    double chase(const page_indices_t &pages, size_t n) {
+        vector<void**> chain;
+        chain.reserve(n * lines);
+        for (size_t i = 0; i < n; ++i)
+            for (size_t l = 0; l < lines; ++l)
+                chain.push_back((void**) (base + M::Page::size * pages[i] + M::CacheLine::size * l));
+        shuffle(chain.begin(), chain.end(), rnd);
+        for (size_t i = 0; i < chain.size(); ++i)
+            *chain[i] = chain[(i + 1) % chain.size()];
+        size_t loads = max(chase_loads, 2 * chain.size());
+        double best = 0;
+        for (size_t attempt = 0; attempt < 3; ++attempt) {
+            void **p = chain[0];
+            for (size_t i = 0; i < chain.size(); ++i)
+                p = (void**) mem_load(p);
+            TimeItNs timeIt { "chase" };
+            for (size_t i = 0; i < loads; ++i)
+                p = (void**) mem_load(p);
+            timeIt.stop();
+            OPTIMIZER_HIDE_VAR(p);
+            double ns = double(timeIt.duration().count()) / loads;
+            best = attempt ? min(best, ns) : ns;
+        }
+        return best;
+    }
+
+    // random pages well below L2 size and above L1 size spread over all sets
+    void measure_l2_hit() {
+        page_indices_t pages(population);
+        iota(pages.begin(), pages.end(), 0);
+        shuffle(pages.begin(), pages.end(), rnd);
+        long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE); // 0 or -1 if unknown
+        size_t n = max(l1 > 0 ? 4 * size_t(l1) : L::size / 8, 4 * M::Page::size) / M::Page::size;
+        n = min(n, population);
+        l2_hit_ns = chase(pages, n);
+        cout << "L2 hit chase " << l2_hit_ns << " ns, " << n << " random pages" << endl;
+    }
+
+    bool spills(const page_indices_t &pages, size_t n) {
+        return chase(pages, n) > spill_ratio * l2_hit_ns && chase(pages, n) > spill_ratio * l2_hit_ns;
+    }
+
+    // smallest n spilling L2, 0 if none up to the group size
+    size_t find_knee(const page_indices_t &pages) {
+        size_t prev = 0;
+        for (size_t n = 1; n <= pages.size(); prev = n, n += max(1ul, n / 16)) {
+            if (!spills(pages, n))
+                continue;
+            for (size_t m = prev + 1; m < n; ++m)
+                if (spills(pages, m))
+                    return m;
+            return n;
+        }
+        return 0;
+    }
+
+    // median of sweeps finding a knee not below floor, no knee counts as the largest
+    size_t median_knee(const page_indices_t &pages, size_t floor) {
+        vector<size_t> found;
+        for (size_t i = 0; i < sweeps; ++i) {
+            size_t knee = find_knee(pages);
+            if (!knee || knee >= floor)
+                found.push_back(knee ? knee : SIZE_MAX);
+        }
+        if (found.empty())
+            return 0;
+        sort(found.begin(), found.end());
+        size_t knee = found[found.size() / 2];
+        return knee == SIZE_MAX ? 0 : knee;
+    }
+
+    void infer_colors_and_ways() {
+        // replacement is not exact LRU, the knee jitters by a page around ways + 1
+        plateau = median_knee(largest_group(window_mask(window_bits)), 0);
+        size_t floor = plateau ? plateau - 1 : 0;
+        for (size_t k = 0; k <= window_bits; ++k) {
+            page_indices_t pages = largest_group(window_mask(k));
+            // no need to sweep far beyond the L2 capacity
+            pages.resize(min(pages.size(), max(4 * L::ways, 2 * (L::size / M::Page::size >> k))));
+            knees.push_back(k == window_bits ? plateau : median_knee(pages, floor));
+            cout << "fixed low bits " << k << " group " << pages.size() << " knee " << knees.back() << " pages" << endl;
+        }
+        auto halves = [&](size_t k) {
+            return !knees[k] || !knees[k + 1] || knees[k + 1] * 4 < knees[k] * 3;
+        };
+        colors_bits = window_bits;
+        while (colors_bits > 0 && !halves(colors_bits - 1))
+            --colors_bits;
+        vector<size_t> flat(knees.begin() + colors_bits, knees.end());
+        sort(flat.begin(), flat.end());
+        size_t knee = flat[(flat.size() - 1) / 2];
+        ways = knee ? knee - 1 : 0;
+    }
+
+    void infer_index_bits() {
+        if (!ways)
+            return;
+        for (size_t b = 0; b < window_bits; ++b) {
+            size_t bit = M::Page::bits + b;
+            page_indices_t pages = largest_group(window_mask(window_bits) & ~(1ul << bit));
+            size_t knee = median_knee(pages, plateau ? plateau - 1 : 0);
+            bool index = !knee || knee * 2 > 3 * (ways + 1);
+            cout << "physical bit " << bit << " free group " << pages.size() << " knee " << knee << " pages"
+                    << (index ? " - index bit" : "") << endl;
+            if (index)
+                index_bits.push_back(bit);
+        }
+    }
+
+    size_t report() {
+        size_t mismatches = 0;
+        auto compare = [&](const char *what, auto inferred, auto model) {
+            bool ok = inferred == model;
+            mismatches += !ok;
+            cout << (ok ? "OK       " : "MISMATCH ") << what << " inferred " << inferred << " model " << model << endl;
+        };
+        auto bits = [](const vector<size_t> &v) {
+            ostringstream out;
+            Delimiter comma { ',' };
+            out << '{';
+            for (auto b : v)
+                out << comma << b;
+            out << '}';
+            return out.str();
+        };
+        vector<size_t> model_bits(C::c_bits);
+        iota(model_bits.begin(), model_bits.end(), M::Page::bits);
+        compare("ways", ways, L::ways);
+        compare("colors", 1ul << colors_bits, C::get_colors_cnt());
+        compare("color bits", bits(index_bits), bits(model_bits));
+        return mismatches;
+    }
+
+    void info() {
+        cout << "page size {model:" << M::Page::size << ",os:" << getpagesize() << ",straddle:" << straddle
+                << "} cache line size " << M::CacheLine::size << endl;
+        cout << "model L2 {size:" << L::size << ",ways:" << L::ways << ",colors:" << C::get_colors_cnt()
+                << ",color bits:" << C::c_bits << "}, window " << window_bits << " bits, pool " << population
+                << " pages" << endl;
+    }
+
+    int run() {
+        info();
+        allocate();
+        measure_l2_hit();
+        infer_colors_and_ways();
+        infer_index_bits();
+        return report() ? 1 : 0;
+    }
+};
+
+int main() {
+    CalibrateL2<HostCacheModel> test;
+    return test.run();
+}
@@ -0,0 +1,78 @@
+#include <compiling.h>
+#include <color_inference.hpp>
+#include <resources.hpp>
+#include <stream_utils.h>
+#include <timing.hpp>
+#include <map>
+
+using namespace std;
+
+template<typename _T>
+struct TestColorInference {
+    using T = IDE_DEFAULT_TYPE(_T, M1);
+    using M = T::Memory;
+    using C = PageColors<T, typename T::L2>;
+    using I = ColorInference<T>;
+    using vaddr_t = uint8_t*;
+    constexpr static size_t straddle = M::Page::size / PAGE_SIZE;
+    size_t population = 2048;
+    vaddr_t base;
+    I inference;
+
+    void allocate() {
+        void *raw;
+        SYS_CALL_MMAP(raw = mmap(0, M::Page::size * (population + 1), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0), "mmap");
+        base = (vaddr_t) align_up(raw, M::Page::size);
+        memset(base, 0, M::Page::size * population);
+    }
+
+    constexpr static double min_purity = 0.9;
+
+    // with pagemap PFNs available pages of a class have to be of the same model color, timing makes few strays,
+    // negative if it can't be verified
+    double verify() {
+        vector<PageMapEntry> base_map(population);
+        get_physical_pages(base, &base_map[0], population, straddle);
+        if (!base_map[0].ptr()) {
+            cout << "no PFN in pagemap, classes are not verified" << endl;
+            return -1;
+        }
+        size_t classified = 0, majority = 0;
+        for (size_t cls = 0; cls < inference.cmap.size(); ++cls) {
+            map<size_t, size_t> colors;
+            for (auto idx : inference.cmap[cls])
+                ++colors[C::get_page_color(base_map[idx].ptr())];
+            Delimiter comma { ',' };
+            cout << "class " << cls << " pages " << inference.cmap[cls].size() << " model colors {";
+            for (auto [c, cnt] : colors)
+                cout << comma << c << ':' << cnt;
+            cout << '}' << endl;
+            classified += inference.cmap[cls].size();
+            majority += max_element(colors.begin(), colors.end(), [](const auto &c1, const auto &c2) {
+                return c1.second < c2.second;
+            })->second;
+        }
+        return classified ? double(majority) / classified : 0;
+    }
+
+    int run() {
+        allocate();
+        {
+            TimeItNs timeIt { "infer_colors" };
+            inference.infer(base, population);
+        }
+        inference.report();
+        CHECK(inference.cmap.size(), "no color class inferred");
+        double purity = verify();
+        if (purity < 0)
+            return 0;
+        cout << "pages of class majority color " << purity * 100 << '%' << endl;
+        return purity < min_purity ? 1 : 0;
+    }
+};
+
+int main() {
+    TestColorInference<HostCacheModel> test;
+    return test.run();
+}
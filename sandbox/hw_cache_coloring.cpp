@@ -1,4 +1,7 @@
 #include <compiling.h>
+#include <color_inference.hpp>
+#include <colored_pool.hpp>
+#include <hw_cache.hpp>
 #include <resources.hpp>
 #include <stream_utils.h>
 #include <timing.hpp>
@@ -10,132 +13,6 @@
 
 using namespace std;
 
-// getconf -a | grep CACHE
-
-/*
- L1 DEDUCTIONS
- - 14 bits 16K page size
- - 7 bits 128B cache line size
- - 128K/16K = 8 pages in L1 - 8 WAY CACHE
- - 16K/128 = 128 sets in L1 each way
-
- L2 CACHE ON M1
- - 12 MB per one core
- - 12 WAY -> 1MB each way
- - 1MB/16KB = 64 PAGES/COLORS in a way
- - 7 bits inside cache line
- - 7 bits to support VIPT out of 14 bits inside cache line (intel has 6 + 6)
- - 6 bits page color
- */
-
-constexpr size_t operator"" _B(unsigned long long v) {
-    return v;
-}
-constexpr size_t operator"" _KB(unsigned long long v) {
-    return v * 1024;
-}
-constexpr size_t operator"" _MB(unsigned long long v) {
-    return v * 1024 * 1024;
-}
-constexpr size_t log2(size_t n) {
-    return ((n < 2) ? 0 : 1 + log2(n / 2));
-}
-
-struct M1 {
-    struct Memory {
-        struct CacheLine {
-            static constexpr size_t size = 128_B;
-            static constexpr size_t bits = log2(size);
-        };
-        struct Page {
-            static constexpr size_t size = 16_KB;
-            static constexpr size_t bits = log2(size);
-        };
-        struct Physical {
-            static constexpr size_t bits = 48;
-        };
-    };
-    struct L2 {
-        static constexpr size_t size = 12_MB;
-        static constexpr size_t ways = 12;
-        static constexpr size_t way_size = size / ways;
-    };
-};
-
-struct Haswell {
-    struct Memory {
-        struct CacheLine {
-            static constexpr size_t size = 64_B;
-            static constexpr size_t bits = log2(size);
-        };
-        struct Page {
-            static constexpr size_t size = 4_KB;
-            static constexpr size_t bits = log2(size);
-        };
-        struct Physical {
-            static constexpr size_t bits = 48;
-        };
-    };
-    struct L2 {
-        static constexpr size_t size = 256_KB;
-        static constexpr size_t ways = 8;
-        static constexpr size_t way_size = size / ways;
-    };
-};
-
-struct Skylake {
-    struct Memory {
-        struct CacheLine {
-            static constexpr size_t size = 64_B;
-            static constexpr size_t bits = log2(size);
-        };
-        struct Page {
-            static constexpr size_t size = 4_KB;
-            static constexpr size_t bits = log2(size);
-        };
-        struct Physical {
-            static constexpr size_t bits = 48;
-        };
-    };
-    struct L2 {
-        static constexpr size_t size = 1_MB;
-        static constexpr size_t ways = 16;
-        static constexpr size_t way_size = size / ways;
-    };
-};
-
-template<typename _T, typename _L>
-struct PageColors {
-    using T = IDE_DEFAULT_TYPE(_T, M1);
-    using L = IDE_DEFAULT_TYPE(_L, T::L2);
-    using M = T::Memory;
-    static constexpr size_t colors = L::way_size / T::Memory::Page::size;
-    static constexpr size_t bits = log2(colors);
-    // https://dinhtta.github.io/cache/
-    // m (tag bits) + s (set bits) + b (line offset bits)
-    // s = c (color bits) + i (uncolored)
-    static constexpr size_t b_bits = M::CacheLine::bits;
-    static constexpr size_t i_bits = M::Page::bits - b_bits;
-    static constexpr size_t c_bits = bits;
-    constexpr static uint64_t make_mask(uint64_t) {
-        return (1ul << bits) - 1;
-    }
-    constexpr static uint64_t extract_bits(uint64_t v, size_t n, size_t c) {
-        return (v >> n) & make_mask(c);
-    }
-    constexpr static size_t get_page_color(void *p) {
-        return extract_bits(uint64_t(p), b_bits + i_bits, c_bits);
-    }
-    constexpr static size_t get_colors_cnt() {
-        return 1ul << c_bits;
-    }
-};
-
-using PageColors_M1L2 = PageColors<M1,M1::L2>;
-static_assert(PageColors_M1L2::b_bits == 7);
-static_assert(PageColors_M1L2::i_bits == 7);
-static_assert(PageColors_M1L2::c_bits == 6);
-
 //static_assert(M1::Memory::CacheLine::size == CACHE_LINE_SIZE);
 //static_assert(M1::Memory::Page::size == PAGE_SIZE);
 
@@ -153,7 +30,11 @@ struct TestL2 {
     using L = T::L2;
     vaddr_t base, tailored;
     vector<PageMapEntry> base_map;
+    string pool_path;           // pages are taken from this shared colored pool when set
+    SharedColoredPool<T> pool;
     cmap_t cmap;                // map of color to vector of pages indices
+    bool inferred = false;      // cmap holds inferred classes, physical addresses are unknown
+    vector<size_t> page_class;  // class of each page when inferred
     cmap_idx_t cmap_idx;        // vector of iterators into original map sorted by pages count
     constexpr static int mmap_prot = PROT_READ | PROT_WRITE;
     constexpr static int mmap_flags = MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE;
@@ -175,8 +56,21 @@ struct TestL2 {
         return (vaddr_t) aligned;
     }
 
+    // physical addresses come from the pool index, pagemap is not read, pages are used without claiming colors
+    void attach_pool() {
+        pool.attach(pool_path);
+        base = pool.data;
+        population = pool.population();
+        cout << "pool " << pool_path << " base virtual address " << (void*) base << ", pages " << population << endl;
+        base_map.resize(population);
+        for (size_t i = 0; i < population; ++i)
+            base_map[i].entry = (void*) (uint64_t(pool.physical(i)) / PAGE_SIZE | PageMapEntry::present);
+    }
+
     void allocate() {
         // assert(T::Memory::CacheLine::size == getpagesize());
+        if (!pool_path.empty())
+            return attach_pool();
         size_t size = M::Page::size * population;
         base = mmap_aligned(population);
         cout << "base virtual address " << (void*) base << ", size " << size << endl;
@@ -185,6 +79,18 @@ struct TestL2 {
     }
 
     void build_colored_pages_map() {
+        if (!base_map[0].ptr()) {
+            // unprivileged, pagemap has no PFNs
+            ColorInference<T> inference;
+            cmap = inference.infer(base, population);
+            inference.report();
+            inferred = true;
+            page_class.assign(population, SIZE_MAX);
+            for (size_t cls = 0; cls < cmap.size(); ++cls)
+                for (auto idx : cmap[cls])
+                    page_class[idx] = cls;
+            return;
+        }
         cmap.resize(C::get_colors_cnt());
         for (auto &e : base_map) {
             void *paddr = e.ptr();
@@ -200,15 +106,25 @@ struct TestL2 {
         sort(cmap_idx.begin(), cmap_idx.end(), [](const auto &it1, const auto &it2) {
             return it1->size() < it2->size();
         });
+        // inference may run out of budget with few classes, bad mapping takes test_pages pages of the largest
+        // color, good one takes pages of the largest colors round robin
+        CHECK(cmap_idx.size() >= 2, "pages of " << cmap_idx.size() << " colors, at least 2 are required");
+        CHECK(cmap_idx.back()->size() >= test_pages,
+                "largest color has " << cmap_idx.back()->size() << " pages, " << test_pages << " are required");
+        for (size_t i = 0; i < test_pages; ++i)
+            CHECK((*(cmap_idx.end() - 1 - i % cmap_idx.size()))->size() > i / cmap_idx.size(),
+                    "too few pages of " << cmap_idx.size() << " colors to spread " << test_pages << " pages");
     }
 
     void dump_colors_index() {
         for (auto &it : cmap_idx) {
             size_t cnt = 0;
             Delimiter comma { ',' };
-            cout << "color " << (&*it - &cmap[0]) << " pages " << it->size() << ' ';
+            cout << (inferred ? "class " : "color ") << (&*it - &cmap[0]) << " pages " << it->size() << ' ';
             for (auto &i : *it) {
-                cout << comma << i << '@' << base_map[i].ptr();
+                cout << comma << i;
+                if (!inferred)
+                    cout << '@' << base_map[i].ptr();
                 if (++cnt > 8) {
                     cout << ",...";
                     break;
@@ -227,6 +143,10 @@ struct TestL2 {
 
     void report_page(size_t idx) {
         void *vaddr = getVirtualAddress(idx);
+        if (inferred) {
+            cout << "page #" << setw(3) << idx << ", vaddr " << vaddr << " class " << page_class[idx] << endl;
+            return;
+        }
         void *paddr = getPhisycalAddress(idx);
         cout << "page #" << setw(3) << idx << ", vaddr " << vaddr << ", physical " << paddr << " "
                 << bitset<64>(uint64_t(paddr)) << " color " << C::get_page_color(paddr) << endl;
@@ -277,7 +197,8 @@ struct TestL2 {
     void test_loop() {
         size_t size = test_pages * M::Page::size;
         cout << "test " << test_pages << " pages at " << (void*) tailored << " total size " << size << endl;
-        report_physical_pages(tailored, test_pages, C::get_page_color, straddle);
+        if (!inferred)
+            report_physical_pages(tailored, test_pages, C::get_page_color, straddle);
         const size_t total_size = M::Page::size * test_pages;
         const size_t stride = M::CacheLine::size;
         const size_t strides = total_size / stride;
@@ -320,11 +241,10 @@ struct TestL2 {
     }
 };
 
-int main() {
-#if IS_ARM
-    TestL2<M1> test;
-#else
-    TestL2<Skylake> test;
-#endif
+// optional argument is a path of shared colored pool to take pages from, see shared_colored_pool.cpp
+int main(int argc, char **argv) {
+    TestL2<HostCacheModel> test;
+    if (argc > 1)
+        test.pool_path = argv[1];
     test.run();
 }
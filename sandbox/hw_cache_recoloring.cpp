@@ -0,0 +1,71 @@
+#include <compiling.h>
+#include <page_recoloring.hpp>
+#include <timing.hpp>
+#include <algorithm> // IWYU keep
+
+using namespace std;
+
+template<typename _T>
+struct TestRecoloring {
+    using T = IDE_DEFAULT_TYPE(_T, M1);
+    using M = T::Memory;
+    using L = T::L2;
+    using C = PageColors<T, typename T::L2>;
+    using R = PageRecoloring<T>;
+    using clock = typename R::clock;
+    constexpr static size_t population = C::get_colors_cnt() * L::ways * 2;
+    constexpr static size_t hot_pages = L::ways * 2;    // all of same color, twice more than ways
+    constexpr static size_t windows = 10;
+    constexpr static auto window = chrono::milliseconds(100);
+    R recoloring;
+    vector<size_t> hot;
+
+    // the worst mapping: hot set is made of the most populated color only
+    void select_hot_pages() {
+        vector<size_t> cnt(C::get_colors_cnt());
+        for (size_t i = 0; i < population; ++i)
+            ++cnt[recoloring.color(i)];
+        size_t color = max_element(cnt.begin(), cnt.end()) - cnt.begin();
+        for (size_t i = 0; i < population && hot.size() < hot_pages; ++i)
+            if (recoloring.color(i) == color)
+                hot.push_back(i);
+        cout << "hot set " << hot.size() << " pages of color " << color << ", ways " << L::ways << endl;
+    }
+
+    // one request of the served workload, writes every cache line of the hot set
+    void serve(uint8_t v) {
+        for (auto idx : hot) {
+            for (size_t l = 0; l < M::Page::size; l += M::CacheLine::size)
+                mem_store(recoloring.page(idx) + l, v);
+            if (recoloring.sampler == R::Sampler::hint)
+                recoloring.hint(idx);
+        }
+    }
+
+    void run() {
+        recoloring.allocate(population, population);
+        select_hot_pages();
+        for (size_t w = 0; w < windows; ++w) {
+            size_t requests = 0;
+            TimeItNs::duration_t best = TimeItNs::duration_t::max();
+            for (auto end = clock::now() + window; clock::now() < end; ++requests) {
+                TimeItNs timeIt { "serve" };
+                serve(requests);
+                timeIt.stop();
+                best = min(best, timeIt.duration());
+                recoloring.step();
+            }
+            cout << "window " << w << " requests " << requests << " best " << RenderDuration { best } << ' ';
+            recoloring.dump_hot_colors();
+        }
+        CHECK(!recoloring.oversubscribed_colors(), "oversubscribed colors left after recoloring");
+        for (auto idx : hot)
+            cout << "hot page #" << idx << " physical " << recoloring.base_map[idx].ptr() << " color "
+                    << recoloring.color(idx) << endl;
+    }
+};
+
+int main() {
+    TestRecoloring<HostCacheModel> test;
+    test.run();
+}
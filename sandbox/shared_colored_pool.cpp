@@ -0,0 +1,104 @@
+#include <compiling.h>
+#include <colored_pool.hpp>
+#include <timing.hpp>
+#include <set>
+#include <sys/wait.h>
+
+using namespace std;
+
+template<typename _T>
+struct TestSharedPool {
+    using T = IDE_DEFAULT_TYPE(_T, M1);
+    using Pool = SharedColoredPool<T>;
+    using M = T::Memory;
+    size_t population = 1024;
+    size_t workers = 4;
+    string path = "/dev/shm/hw_cache_colored_pool." + to_string(getpid());
+    bool keep = false;
+    Pool pool;
+    int claimed[2], go[2];      // workers report claimed colors, parent closes go once all of them hold one
+
+    void create() {
+        TimeItNs timeIt { "create_pool" };
+        pool.create(path, population);
+    }
+
+    // runs in a forked process, attaches by path as an unrelated process would,
+    // holds its color until every worker has claimed one
+    int worker(size_t id) {
+        SYS_CALL(close(claimed[0]), "close");
+        SYS_CALL(close(go[1]), "close");
+        Pool p;
+        {
+            TimeItNs timeIt { "attach_pool" };
+            p.attach(path);
+        }
+        int color = p.claim_color();
+        CHECK(color >= 0, "no free color for worker " << id);
+        SYS_CALL_CHECK(write(claimed[1], &color, sizeof(color)) != sizeof(color), "write");
+        vector<typename Pool::index_t> pages;
+        for (auto idx = p.pop(color); idx != Pool::npos; idx = p.pop(color))
+            pages.push_back(idx);
+        for (auto idx : pages) {
+            CHECK(p.color_of(idx) == size_t(color), "page " << idx << " color " << p.color_of(idx));
+            memset(p.page(idx), id, M::Page::size);
+        }
+        cout << "worker " << id << " pid " << getpid() << " claimed color " << color << " pages " << pages.size()
+                << endl;
+        char c;
+        SYS_CALL(read(go[0], &c, 1), "read");
+        for (auto idx : pages)
+            p.push(color, idx);
+        p.release_color(color);
+        return 0;
+    }
+
+    void run() {
+        create();
+        pool.dump_colors();
+        SYS_CALL(pipe(claimed), "pipe");
+        SYS_CALL(pipe(go), "pipe");
+        vector<pid_t> pids;
+        for (size_t i = 0; i < workers; ++i) {
+            pid_t pid;
+            SYS_CALL(pid = fork(), "fork");
+            if (!pid)
+                exit(worker(i));
+            pids.push_back(pid);
+        }
+        SYS_CALL(close(claimed[1]), "close");
+        set<int> colors;
+        for (size_t i = 0; i < workers; ++i) {
+            int color;
+            SYS_CALL_CHECK(read(claimed[0], &color, sizeof(color)) != sizeof(color), "read");
+            colors.insert(color);
+        }
+        CHECK(colors.size() == workers, "workers claimed " << colors.size() << " distinct colors");
+        cout << "workers hold " << colors.size() << " distinct colors" << endl;
+        // EOF on go releases workers
+        SYS_CALL(close(go[1]), "close");
+        SYS_CALL(close(claimed[0]), "close");
+        SYS_CALL(close(go[0]), "close");
+        for (auto pid : pids) {
+            int status;
+            SYS_CALL(waitpid(pid, &status, 0), "waitpid");
+            CHECK(WIFEXITED(status) && !WEXITSTATUS(status), "worker " << pid << " failed");
+        }
+        CHECK(!pool.reclaim_dead_owners(), "some worker did not release its color");
+        pool.dump_colors();
+        if (keep)
+            cout << "pool is kept at " << path << endl;
+        else
+            SYS_CALL(unlink(path.c_str()), "unlink");
+    }
+};
+
+// optional argument is a path the pool is created at and kept, e.g. for hw_cache_coloring <path>
+int main(int argc, char **argv) {
+    TestSharedPool<HostCacheModel> test;
+    if (argc > 1) {
+        test.path = argv[1];
+        test.keep = true;
+    }
+    test.run();
+}
@@ -0,0 +1,121 @@
+#!/bin/bash
+# usage: bench.sh <report> <binary>...
+# Runs every benchmark pinned to one isolated core with memory bound to the core's local NUMA node,
+# records the host settings that make numbers from different machines (in)comparable into one report.
+# BENCH_CPU=<n> overrides the core selection, BENCH_CFLAGS is recorded as the flags benchmarks were built with.
+
+set -uo pipefail
+
+YELLOW='\033[1;33m'
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+RESET='\033[0m'
+
+REPORT=$1
+shift
+SYS_CPU=/sys/devices/system/cpu
+THP=/sys/kernel/mm/transparent_hugepage
+
+warn() {
+  echo -e "${YELLOW}WARNING:${RESET} $*" >&2
+  echo "WARNING: $*" >> ${REPORT}
+}
+
+read_sys() {
+  [[ -r $1 ]] && cat $1 || echo "n/a"
+}
+
+# one cpu per line out of list like "2-3,6"
+expand_cpus() {
+  echo $1 | tr ',' '\n' | awk -F- 'NF { last = NF > 1 ? $2 : $1; for (c = $1; c <= last; ++c) print c }'
+}
+
+# cpus the cgroup cpuset lets this process run on, isolated cpus are not in the affinity mask by default
+# but may be in the cpuset, so the mask is only the fallback
+allowed_cpus() {
+  local v2=$(grep -m 1 '^0::' /proc/self/cgroup | cut -d: -f3)
+  local v1=$(grep -m 1 ':cpuset:' /proc/self/cgroup | cut -d: -f3)
+  if [[ -n ${v2} && -r /sys/fs/cgroup${v2}/cpuset.cpus.effective ]]; then
+    cat /sys/fs/cgroup${v2}/cpuset.cpus.effective
+  elif [[ -n ${v1} && -r /sys/fs/cgroup/cpuset${v1}/cpuset.effective_cpus ]]; then
+    cat /sys/fs/cgroup/cpuset${v1}/cpuset.effective_cpus
+  else
+    grep Cpus_allowed_list /proc/self/status | cut -f2
+  fi
+}
+
+select_cpu() {
+  local allowed=$(expand_cpus $(allowed_cpus))
+  local isolated=$(expand_cpus $(read_sys ${SYS_CPU}/isolated | sed 's/n\/a//'))
+  local cpu=$(comm -12 <(echo "${isolated}" | sort) <(echo "${allowed}" | sort) | sort -n | head -n 1)
+  if [[ -n ${BENCH_CPU:-} ]]; then
+    echo ${BENCH_CPU}
+  elif [[ -n ${cpu} ]]; then
+    echo ${cpu}
+  else
+    # the last allowed cpu is usually the least loaded by the kernel housekeeping
+    echo "${allowed}" | tail -n 1
+  fi
+}
+
+cpu_node() {
+  local node=$(ls -d ${SYS_CPU}/cpu$1/node* 2>/dev/null | head -n 1)
+  [[ -n ${node} ]] && echo ${node##*node} || echo 0
+}
+
+mkdir -p $(dirname ${REPORT})
+: > ${REPORT}
+
+CPU=$(select_cpu)
+NODE=$(cpu_node ${CPU})
+GOVERNOR=$(read_sys ${SYS_CPU}/cpu${CPU}/cpufreq/scaling_governor)
+SIBLINGS=$(read_sys ${SYS_CPU}/cpu${CPU}/topology/thread_siblings_list)
+SMT=$(read_sys ${SYS_CPU}/smt/active)
+THP_ENABLED=$(read_sys ${THP}/enabled)
+THP_DEFRAG=$(read_sys ${THP}/defrag)
+
+{
+  echo "date: $(date -u +%FT%TZ)"
+  echo "host: $(uname -n) $(uname -srm)"
+  echo "cpu model: $(grep -m 1 'model name' /proc/cpuinfo | cut -d: -f2- | sed 's/^ *//')"
+  echo "compiler: $(g++ --version | head -n 1)"
+  echo "bench flags: ${BENCH_CFLAGS:-n/a}"
+  echo "native march: $(g++ -march=native -Q --help=target | awk '$1 == "-march=" { print $2; exit }')"
+  echo "revision: $(git rev-parse --short HEAD 2>/dev/null || echo n/a)"
+  echo "isolated cpus: $(read_sys ${SYS_CPU}/isolated)"
+  echo "bench cpu: ${CPU}, numa node: ${NODE}, thread siblings: ${SIBLINGS}"
+  echo "governor: ${GOVERNOR}"
+  echo "smt active: ${SMT}"
+  echo "thp enabled: ${THP_ENABLED}"
+  echo "thp defrag: ${THP_DEFRAG}"
+} >> ${REPORT}
+
+[[ -z $(expand_cpus $(read_sys ${SYS_CPU}/isolated | sed 's/n\/a//') | grep -x "${CPU}") ]] && \
+  warn "cpu ${CPU} is not isolated (isolcpus=), it is shared with other tasks"
+[[ ${GOVERNOR} != "performance" ]] && warn "cpu ${CPU} frequency governor is '${GOVERNOR}', expected 'performance'"
+[[ ${SMT} == "1" && ${SIBLINGS} =~ [,-] ]] && warn "SMT is active, cpu ${CPU} shares its core with ${SIBLINGS}"
+[[ ${THP_ENABLED} != *"[never]"* ]] && warn "transparent huge pages are not disabled: ${THP_ENABLED}"
+
+if which numactl >/dev/null 2>&1; then
+  PIN="numactl --physcpubind=${CPU} --membind=${NODE}"
+else
+  warn "numactl is not found, memory is not bound to node ${NODE}"
+  PIN="taskset -c ${CPU}"
+fi
+echo "pinning: ${PIN}" >> ${REPORT}
+
+RC=0
+for bin in "$@"; do
+  echo -e "${GREEN}BENCH${RESET} ${bin}"
+  echo -e "\n=== ${bin} ===" >> ${REPORT}
+  ${PIN} ./${bin} >> ${REPORT} 2>&1
+  status=$?
+  echo "=== ${bin} exit status ${status} ===" >> ${REPORT}
+  if [[ ${status} != 0 ]]; then
+    echo -e "${RED}FAILED${RESET} ${bin} exit status ${status}" >&2
+    RC=1
+  fi
+done
+
+echo "report: ${REPORT}"
+exit ${RC}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <compiling.h>
+#include <hw_cache.hpp>
+#include <timing.hpp>
+#include <algorithm> // IWYU keep
+#include <atomic>
+#include <chrono>
+#include <numeric>
+#include <pthread.h>
+#include <random>
+#include <sched.h>
+#include <thread>
+
+/*
+ COLOR INFERENCE WITHOUT PFN
+ - unprivileged processes read zero PFNs from /proc/self/pagemap, so colors are inferred by timing conflicts
+ - access kernel reads few cache lines of every page of a set in a loop like TestL2::test_loop and then times
+   a dependent chase over the same lines of a target page, the target is evicted to L3 once the set has ways
+   pages of target color, timing the target only keeps the signal when the rest of the set fits
+ - one color at a time: target is the first unclassified page, grow a set of unclassified pages until it
+   evicts the target, reduce it by group elimination to a core of few pages more than ways which still evicts it,
+   L2 replacement is adaptive and often keeps the target with exactly ways pages of its color
+ - a page has the core color only if the core evicts it, every remaining page is tested once on worker threads
+   pinned to different physical cores, so each worker has its own L2
+ - classified pages leave the unclassified set, search stops once too few pages are left to evict
+   or the time budget is over, pages left are reported as unclassified
+ - classes are labels, not physical colors, probe lines of every page are overwritten once with a pointer chain
+   before the search, so measurements only read and workers never write pages other workers read
+ */
+
+template<typename _T>
+struct ColorInference {
+    using T = IDE_DEFAULT_TYPE(_T, M1);
+    using M = T::Memory;
+    using L = T::L2;
+    using vaddr_t = uint8_t*;
+    using page_indices_t = std::vector<size_t>;
+    using cmap_t = std::vector<page_indices_t>;
+    using clock = std::chrono::steady_clock;
+    constexpr static size_t core_pages = L::ways + L::ways / 4;
+    constexpr static uint64_t min_fit_ticks = 64;   // eviction ratio is meaningless near timer resolution
+
+    struct Config {
+        clock::duration budget = std::chrono::seconds(10);
+        // cache lines per page touched by the access kernel, ARM counter ticks at 24 MHz, so a chase of
+        // few lines hitting L2 takes 0 to 2 ticks, there it chases every line of the page
+        size_t probe_lines = IS_ARM ? M::Page::size / M::CacheLine::size : 8;
+        size_t rounds = 16;         // loops of the access kernel per measurement, fewer for large sets
+        size_t min_rounds = 4;
+        size_t set_loads = 1 << 16; // set lines read per measurement above which rounds are cut
+        size_t passes = 2;          // set reads before each target chase, replacement is not LRU
+        double spill_ratio = 3.5;   // target slowdown against L2 hit which means eviction, large sets make
+                                    // up to 3x with one or two pages of target color less than ways
+        size_t backtracks = 32;     // per reduction
+        size_t failures = 8;        // targets in a row for which no core is found before giving up
+        size_t threads = 0;         // classification workers, 0 - one per physical core
+    };
+
+    Config config;
+    vaddr_t base = nullptr;
+    size_t population = 0;
+    cmap_t cmap;                    // map of inferred class to vector of pages indices
+    page_indices_t unclassified;
+    clock::time_point deadline;
+    std::atomic<size_t> tests { 0 };
+    std::mt19937_64 rnd { 42 };
+
+    bool expired() const {
+        return clock::now() > deadline;
+    }
+
+    vaddr_t line(size_t idx, size_t l) const {
+        size_t step = M::Page::size / config.probe_lines / M::CacheLine::size * M::CacheLine::size;
+        return base + M::Page::size * idx + step * l;
+    }
+
+    // probe lines of a page point to each other so a target is read by a dependent chase
+    void chain(size_t idx) {
+        for (size_t l = 0; l < config.probe_lines; ++l)
+            *(void**) line(idx, l) = line(idx, (l + 1) % config.probe_lines);
+    }
+
+    // ticks of the target chase after reading the set, best of few attempts
+    uint64_t target_time(size_t target, const page_indices_t &set) {
+        ++tests;
+        std::vector<vaddr_t> lines;
+        lines.reserve(set.size() * config.probe_lines);
+        for (auto idx : set)
+            for (size_t l = 0; l < config.probe_lines; ++l)
+                lines.push_back(line(idx, l));
+        size_t rounds = std::clamp(config.set_loads / std::max(1ul, lines.size()), config.min_rounds, config.rounds);
+        uint64_t best = 0;
+        for (size_t attempt = 0; attempt < 3; ++attempt) {
+            uint64_t ticks = 0;
+            void **p = (void**) line(target, 0);
+            for (size_t i = 0; i < rounds; ++i) {
+                for (size_t pass = 0; pass < config.passes; ++pass)
+                    for (auto l : lines)
+                        mem_load(l);
+                LOAD_FENCE;
+                uint64_t start = __rdtsc();
+                for (size_t l = 0; l < config.probe_lines; ++l)
+                    p = (void**) mem_load(p);
+                LOAD_FENCE;
+                ticks += __rdtsc() - start;
+            }
+            OPTIMIZER_HIDE_VAR(p);
+            ticks = ticks * config.rounds / rounds;
+            best = attempt ? std::min(best, ticks) : ticks;
+        }
+        return best;
+    }
+
+    // ways random pages never exceed ways per set, yet exceed L1 ways, so the target is read from L2,
+    // targets are not taken from excluded pages
+    uint64_t measure_fit(std::mt19937_64 &g, const page_indices_t &exclude = { }) {
+        uint64_t fit = 0;
+        std::uniform_int_distribution<size_t> any(0, population - 1);
+        for (size_t t = 0; t < 4; ++t) {
+            page_indices_t set;
+            size_t target;
+            do {
+                target = any(g);
+            } while (std::find(exclude.begin(), exclude.end(), target) != exclude.end());
+            while (set.size() < L::ways) {
+                size_t idx = any(g);
+                if (idx != target)
+                    set.push_back(idx);
+            }
+            uint64_t ticks = target_time(target, set);
+            fit = t ? std::min(fit, ticks) : ticks;
+        }
+        CHECK(fit >= min_fit_ticks, "L2 hit takes " << fit << " ticks, increase probe lines or rounds");
+        return fit;
+    }
+
+    bool evicts(size_t target, const page_indices_t &set, uint64_t fit) {
+        return target_time(target, set) > config.spill_ratio * fit && target_time(target, set) > config.spill_ratio * fit;
+    }
+
+    page_indices_t prefix(size_t n) const {
+        return page_indices_t(unclassified.begin() + 1, unclassified.begin() + 1 + n);
+    }
+
+    // short prefix of unclassified pages after the target which evicts it, empty if none,
+    // reduction of a set twice smaller costs ways + 1 tests less at the largest sizes, but the shortest one
+    // has barely enough pages of target color and reduction gets stuck, so a quarter more is kept
+    page_indices_t grow(size_t target, uint64_t fit) {
+        size_t lo = 0, hi = 0;
+        for (size_t n = 2 * L::ways; !expired(); n *= 2) {
+            n = std::min(n, unclassified.size() - 1);
+            if (evicts(target, prefix(n), fit)) {
+                hi = n;
+                break;
+            }
+            lo = n;
+            if (n == unclassified.size() - 1)
+                return {};
+        }
+        while (hi && hi - lo > core_pages && !expired()) {
+            size_t mid = (lo + hi) / 2;
+            (evicts(target, prefix(mid), fit) ? hi : lo) = mid;
+        }
+        return hi ? prefix(std::min(hi + hi / 4, unclassified.size() - 1)) : page_indices_t { };
+    }
+
+    // group elimination: one of ways + 1 groups holds none of some ways evicting pages,
+    // so the set still evicts the target without it; page table walks and other lines of large sets take
+    // a way or so, then a group with a page of target color may be dropped and later the set stops evicting,
+    // so it backtracks to the previous set and tries the next group
+    bool reduce(size_t target, page_indices_t &s, uint64_t fit) {
+        std::vector<std::pair<page_indices_t, size_t>> history;   // set before removal, next group to try
+        size_t backtracks = 0, g = 0;
+        while (s.size() > core_pages) {
+            if (expired())
+                return false;
+            size_t groups = std::min(L::ways + 1, s.size());
+            bool removed = false;
+            for (; g < groups && !removed; ++g) {
+                page_indices_t rest;
+                for (size_t i = 0; i < s.size(); ++i)
+                    if (i * groups / s.size() != g)
+                        rest.push_back(s[i]);
+                if (evicts(target, rest, fit)) {
+                    history.emplace_back(std::move(s), g + 1);
+                    s.swap(rest);
+                    removed = true;
+                }
+            }
+            if (removed) {
+                g = 0;
+                continue;
+            }
+            if (history.empty() || ++backtracks > config.backtracks)
+                return false;
+            s.swap(history.back().first);
+            g = history.back().second;
+            history.pop_back();
+        }
+        return true;
+    }
+
+    // first cpu of every physical core this process may run on
+    static std::vector<int> physical_cores() {
+        cpu_set_t set;
+        SYS_CALL(sched_getaffinity(0, sizeof(set), &set), "sched_getaffinity");
+        std::vector<int> cores;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &set))
+                continue;
+            std::ifstream siblings { "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list" };
+            int first = cpu;
+            siblings >> first;
+            if (first == cpu || !CPU_ISSET(first, &set))
+                cores.push_back(cpu);
+        }
+        return cores;
+    }
+
+    static void pin(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        CHECK(!rc, "pthread_setaffinity_np " << strerror(rc));
+    }
+
+    // tests every unclassified page but the core against the core, returns flags of pages having the core color
+    std::vector<uint8_t> classify(const page_indices_t &core) {
+        std::vector<uint8_t> member(unclassified.size());
+        std::atomic<size_t> next { 0 };
+        // worker is pinned before measuring fit, so the fit is of the L2 it tests on
+        auto worker = [&](int cpu, uint64_t seed) {
+            pin(cpu);
+            std::mt19937_64 g { seed };
+            uint64_t fit = measure_fit(g, core);
+            // positives are confirmed, one noisy burst is enough to slow down both measurements of a test
+            for (size_t i; (i = next++) < unclassified.size() && !expired();)
+                if (std::find(core.begin(), core.end(), unclassified[i]) == core.end())
+                    member[i] = evicts(unclassified[i], core, fit) && evicts(unclassified[i], core, fit);
+        };
+        auto cores = physical_cores();
+        size_t threads = std::max(1ul, std::min(config.threads ? config.threads : cores.size(), cores.size()));
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t)
+            workers.emplace_back(worker, cores[t], rnd());
+        for (auto &w : workers)
+            w.join();
+        return member;
+    }
+
+    bool infer_class(uint64_t fit) {
+        size_t target = unclassified.front();
+        page_indices_t core = grow(target, fit);
+        if (core.empty() || !reduce(target, core, fit) || !evicts(target, core, fit))
+            return false;
+        auto member = classify(core);
+        page_indices_t cls, rest;
+        for (size_t i = 0; i < unclassified.size(); ++i) {
+            if (std::find(core.begin(), core.end(), unclassified[i]) != core.end())
+                continue;
+            (member[i] ? cls : rest).push_back(unclassified[i]);
+        }
+        // core keeps few pages of other colors, they are told apart by a core made of classified pages
+        if (cls.size() >= core_pages) {
+            page_indices_t check(cls.begin(), cls.begin() + core_pages);
+            for (auto idx : core)
+                (evicts(idx, check, fit) ? cls : rest).push_back(idx);
+        } else {
+            cls.insert(cls.end(), core.begin(), core.end());
+        }
+        cmap.push_back(cls);
+        unclassified.swap(rest);
+        return true;
+    }
+
+    // fills cmap with classes of pages of same color, returns it
+    const cmap_t& infer(vaddr_t b, size_t pages) {
+        base = b;
+        population = pages;
+        // search runs on one L2 as workers do, thread affinity is restored when done
+        cpu_set_t affinity;
+        SYS_CALL(sched_getaffinity(0, sizeof(affinity), &affinity), "sched_getaffinity");
+        pin(physical_cores()[0]);
+        deadline = clock::now() + config.budget;
+        unclassified.resize(population);
+        std::iota(unclassified.begin(), unclassified.end(), 0);
+        std::shuffle(unclassified.begin(), unclassified.end(), rnd);
+        for (size_t i = 0; i < population; ++i)
+            chain(i);
+        uint64_t fit = measure_fit(rnd);
+        size_t failures = 0;
+        // few failed attempts are fine, timing is noisy and the target may be the only page of its color
+        while (unclassified.size() > core_pages && !expired() && failures < config.failures) {
+            if (infer_class(fit)) {
+                failures = 0;
+            } else {
+                ++failures;
+                std::rotate(unclassified.begin(), unclassified.begin() + 1, unclassified.end());
+            }
+        }
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+        CHECK(!rc, "pthread_setaffinity_np " << strerror(rc));
+        return cmap;
+    }
+
+    void report() const {
+        std::cout << "inferred " << cmap.size() << " color classes of " << population << " pages, unclassified "
+                << unclassified.size() << ", tests " << tests << std::endl;
+    }
+};
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <compiling.h>
+#include <hw_cache.hpp>
+#include <resources.hpp>
+#include <atomic>
+#include <csignal>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+/*
+ SHARED COLORED PAGE POOL
+ - pages live in a file (tmpfs/hugetlbfs path or memfd) so several processes can map the same physical pages
+ - all pages are mlock-ed by every process mapping the pool, that keeps them resident so PFNs stay stable
+   (hugetlbfs pages are never migrated, tmpfs pages may still be moved by compaction unless
+   vm.compact_unevictable_allowed=0)
+ - file layout: header pages | data pages, both in model page units
+ - header keeps color index built once by the creator: per page physical address, per color lock-free free list
+   and owner, so attaching processes start without rescanning /proc/self/pagemap
+ - creator builds the pool under a temporary name and links it to the path once the index is ready,
+   so a process finding the path never maps a partial pool
+ */
+
+template<typename _T>
+struct SharedColoredPool {
+    using T = IDE_DEFAULT_TYPE(_T, M1);
+    using M = T::Memory;
+    using C = PageColors<T, typename T::L2>;
+    using vaddr_t = uint8_t*;
+    using index_t = uint32_t;
+    static constexpr uint64_t magic = 0x4c4f4f50524c4f43; // "COLRPOOL"
+    static constexpr index_t npos = UINT32_MAX;
+    static constexpr size_t straddle = M::Page::size / PAGE_SIZE;
+    static_assert(M::Page::size % PAGE_SIZE == 0);
+
+    struct Color {
+        std::atomic<int32_t> owner;     // pid of claiming process, 0 if unclaimed
+        std::atomic<uint32_t> count;    // pages currently in the free list
+        std::atomic<uint64_t> head;     // free list head: (aba tag << 32) | page index
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+    static_assert(std::atomic<int32_t>::is_always_lock_free);
+
+    struct Header {
+        std::atomic<uint64_t> ready;    // magic once the index is built
+        uint64_t page_size;
+        uint64_t colors;
+        uint64_t population;
+        uint64_t header_pages;
+        Color color[C::get_colors_cnt()];
+        // followed by uint64_t paddr[population] and std::atomic<index_t> next[population],
+        // paddr goes first so it stays 8 bytes aligned for any population
+    };
+    static_assert(sizeof(Header) % alignof(uint64_t) == 0);
+
+    std::string path;
+    int fd = -1;
+    size_t size = 0;
+    Header *header = nullptr;
+    std::atomic<index_t> *next = nullptr;   // free list links, one per page
+    uint64_t *paddr = nullptr;              // physical address of each page
+    vaddr_t data = nullptr;
+
+    SharedColoredPool() = default;
+    SharedColoredPool(const SharedColoredPool&) = delete;
+    SharedColoredPool& operator=(const SharedColoredPool&) = delete;
+    ~SharedColoredPool() {
+        if (header)
+            SYS_CALL(munmap(header, size), "munmap");
+        if (fd >= 0)
+            SYS_CALL(close(fd), "close");
+    }
+
+    static size_t header_bytes(size_t population) {
+        return sizeof(Header) + population * (sizeof(std::atomic<index_t>) + sizeof(uint64_t));
+    }
+
+    // empty path creates memfd, other processes attach via "/proc/<pid>/fd/<fd>" which is stored in path
+    void create(const std::string &p, size_t population) {
+        CHECK(population < npos, "population " << population);
+        if (p.empty()) {
+            SYS_CALL(fd = memfd_create("colored_pool", 0), "memfd_create");
+            path = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+        } else {
+            path = p + ".tmp." + std::to_string(getpid());
+            SYS_CALL(fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600), "open");
+        }
+        size_t header_pages = (header_bytes(population) + M::Page::size - 1) / M::Page::size;
+        size = (header_pages + population) * M::Page::size;
+        // hugetlbfs requires size in huge pages
+        struct statfs fs;
+        SYS_CALL(fstatfs(fd, &fs), "fstatfs");
+        size = (size + fs.f_bsize - 1) / fs.f_bsize * fs.f_bsize;
+        SYS_CALL(ftruncate(fd, size), "ftruncate");
+        map();
+
+        header->page_size = M::Page::size;
+        header->colors = C::get_colors_cnt();
+        header->population = population;
+        header->header_pages = header_pages;
+        bind_arrays();
+        memset(data, 0, population * M::Page::size); // make sure each page is backed before reading PFNs
+        build_color_index();
+        header->ready.store(magic, std::memory_order_release);
+        if (!p.empty()) {
+            // link fails if the path exists, like O_EXCL would
+            SYS_CALL(link(path.c_str(), p.c_str()), "link");
+            SYS_CALL(unlink(path.c_str()), "unlink");
+            path = p;
+        }
+    }
+
+    void attach(const std::string &p) {
+        SYS_CALL(fd = open(p.c_str(), O_RDWR), "open");
+        path = p;
+        struct stat st;
+        SYS_CALL(fstat(fd, &st), "fstat");
+        size = st.st_size;
+        CHECK(size >= sizeof(Header), "pool file is too small " << size);
+        map();
+        CHECK(header->ready.load(std::memory_order_acquire) == magic, "pool " << p << " is not ready or not a pool");
+        CHECK(header->page_size == M::Page::size, "pool page size " << header->page_size);
+        CHECK(header->colors == C::get_colors_cnt(), "pool colors " << header->colors);
+        // header sizes arrays and data, a truncated file must not be trusted
+        CHECK(header->population < npos && header_bytes(header->population) <= header->header_pages * M::Page::size,
+                "pool header pages " << header->header_pages << " population " << header->population);
+        CHECK(size >= (header->header_pages + header->population) * M::Page::size, "pool file is too small " << size);
+        bind_arrays();
+    }
+
+    void map() {
+        void *ptr;
+        SYS_CALL_MMAP(ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0), "mmap");
+        SYS_CALL(mlock(ptr, size), "mlock");
+        header = (Header*) ptr;
+    }
+
+    void bind_arrays() {
+        paddr = reinterpret_cast<uint64_t*>(header + 1);
+        next = reinterpret_cast<std::atomic<index_t>*>(paddr + header->population);
+        data = (vaddr_t) header + header->header_pages * M::Page::size;
+    }
+
+    void build_color_index() {
+        std::vector<PageMapEntry> entries(population());
+        get_physical_pages(data, &entries[0], population(), straddle);
+        for (size_t c = 0; c < colors(); ++c) {
+            new (&header->color[c]) Color { };
+            header->color[c].head.store(npos);
+        }
+        for (size_t i = 0; i < population(); ++i) {
+            paddr[i] = uint64_t(entries[i].ptr());
+            CHECK(paddr[i], "no PFN for page " << i << ", reading pagemap requires CAP_SYS_ADMIN");
+            new (&next[i]) std::atomic<index_t> { npos };
+            push(C::get_page_color((void*) paddr[i]), i);
+        }
+    }
+
+    size_t population() const {
+        return header->population;
+    }
+    size_t colors() const {
+        return header->colors;
+    }
+    vaddr_t page(index_t idx) const {
+        return data + M::Page::size * idx;
+    }
+    void* physical(index_t idx) const {
+        return (void*) paddr[idx];
+    }
+    size_t color_of(index_t idx) const {
+        return C::get_page_color(physical(idx));
+    }
+    size_t free_pages(size_t color) const {
+        return header->color[color].count.load(std::memory_order_relaxed);
+    }
+    int32_t owner(size_t color) const {
+        return header->color[color].owner.load(std::memory_order_relaxed);
+    }
+
+    // Treiber stack, tag in the upper half of head protects against ABA
+    index_t pop(size_t color) {
+        auto &c = header->color[color];
+        uint64_t head = c.head.load(std::memory_order_acquire);
+        for (;;) {
+            index_t idx = index_t(head);
+            if (idx == npos)
+                return npos;
+            uint64_t new_head = ((head >> 32) + 1) << 32 | next[idx].load(std::memory_order_relaxed);
+            if (c.head.compare_exchange_weak(head, new_head, std::memory_order_acquire, std::memory_order_acquire))
+                break;
+        }
+        c.count.fetch_sub(1, std::memory_order_relaxed);
+        return index_t(head);
+    }
+
+    void push(size_t color, index_t idx) {
+        assert(color_of(idx) == color);
+        auto &c = header->color[color];
+        // counted before it is published, so a concurrent pop never takes count below zero
+        c.count.fetch_add(1, std::memory_order_relaxed);
+        uint64_t head = c.head.load(std::memory_order_relaxed);
+        uint64_t new_head;
+        do {
+            next[idx].store(index_t(head), std::memory_order_relaxed);
+            new_head = ((head >> 32) + 1) << 32 | idx;
+        } while (!c.head.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool claim_color(size_t color) {
+        int32_t expected = 0;
+        return header->color[color].owner.compare_exchange_strong(expected, getpid());
+    }
+
+    // claims unowned color with the most free pages, -1 if every color is taken
+    int claim_color() {
+        for (;;) {
+            int best = -1;
+            for (size_t c = 0; c < colors(); ++c)
+                if (!owner(c) && free_pages(c) && (best < 0 || free_pages(c) > free_pages(best)))
+                    best = c;
+            if (best < 0 || claim_color(best))
+                return best;
+        }
+    }
+
+    void release_color(size_t color) {
+        int32_t expected = getpid();
+        CHECK(header->color[color].owner.compare_exchange_strong(expected, 0),
+                "color " << color << " is owned by " << expected);
+    }
+
+    // returns colors of processes which exited without releasing them
+    size_t reclaim_dead_owners() {
+        size_t reclaimed = 0;
+        for (size_t c = 0; c < colors(); ++c) {
+            int32_t pid = owner(c);
+            if (pid && kill(pid, 0) < 0 && errno == ESRCH)
+                reclaimed += header->color[c].owner.compare_exchange_strong(pid, 0);
+        }
+        return reclaimed;
+    }
+
+    void dump_colors() const {
+        std::cout << "pool " << path << " pages " << population() << " colors " << colors() << " header pages "
+                << header->header_pages << std::endl;
+        for (size_t c = 0; c < colors(); ++c)
+            std::cout << "color " << c << " free " << free_pages(c) << " owner " << owner(c) << std::endl;
+    }
+};
@@ -22,6 +22,11 @@
 #define PACKED __attribute__((packed))
 #define COMPILER_BARRIER asm volatile("": : :"memory")
 #define CACHE_LINE_ALIGNED __attribute__((__aligned__((CACHE_LINE_SIZE))))
+#if __x86_64
+#define LOAD_FENCE __builtin_ia32_lfence() // wait for prior loads to complete
+#else
+#define LOAD_FENCE asm volatile("dsb ld" : : : "memory")
+#endif
 #define OPTIMIZER_HIDE_VAR(var) __asm__ ("" : "=r" (var) : "0" (var)) // Make the optimizer believe the variable can be manipulated arbitrarily
 #define IS_ARM (!__x86_64)
 #define IS_INTEL (!!__x86_64)
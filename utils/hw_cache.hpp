@@ -0,0 +1,135 @@
+#pragma once
+
+#include <compiling.h>
+
+// getconf -a | grep CACHE
+
+/*
+ L1 DEDUCTIONS
+ - 14 bits 16K page size
+ - 7 bits 128B cache line size
+ - 128K/16K = 8 pages in L1 - 8 WAY CACHE
+ - 16K/128 = 128 sets in L1 each way
+
+ L2 CACHE ON M1
+ - 12 MB per one core
+ - 12 WAY -> 1MB each way
+ - 1MB/16KB = 64 PAGES/COLORS in a way
+ - 7 bits inside cache line
+ - 7 bits to support VIPT out of 14 bits inside cache line (intel has 6 + 6)
+ - 6 bits page color
+ */
+
+constexpr size_t operator"" _B(unsigned long long v) {
+    return v;
+}
+constexpr size_t operator"" _KB(unsigned long long v) {
+    return v * 1024;
+}
+constexpr size_t operator"" _MB(unsigned long long v) {
+    return v * 1024 * 1024;
+}
+constexpr size_t log2(size_t n) {
+    return ((n < 2) ? 0 : 1 + log2(n / 2));
+}
+
+struct M1 {
+    struct Memory {
+        struct CacheLine {
+            static constexpr size_t size = 128_B;
+            static constexpr size_t bits = log2(size);
+        };
+        struct Page {
+            static constexpr size_t size = 16_KB;
+            static constexpr size_t bits = log2(size);
+        };
+        struct Physical {
+            static constexpr size_t bits = 48;
+        };
+    };
+    struct L2 {
+        static constexpr size_t size = 12_MB;
+        static constexpr size_t ways = 12;
+        static constexpr size_t way_size = size / ways;
+    };
+};
+
+struct Haswell {
+    struct Memory {
+        struct CacheLine {
+            static constexpr size_t size = 64_B;
+            static constexpr size_t bits = log2(size);
+        };
+        struct Page {
+            static constexpr size_t size = 4_KB;
+            static constexpr size_t bits = log2(size);
+        };
+        struct Physical {
+            static constexpr size_t bits = 48;
+        };
+    };
+    struct L2 {
+        static constexpr size_t size = 256_KB;
+        static constexpr size_t ways = 8;
+        static constexpr size_t way_size = size / ways;
+    };
+};
+
+struct Skylake {
+    struct Memory {
+        struct CacheLine {
+            static constexpr size_t size = 64_B;
+            static constexpr size_t bits = log2(size);
+        };
+        struct Page {
+            static constexpr size_t size = 4_KB;
+            static constexpr size_t bits = log2(size);
+        };
+        struct Physical {
+            static constexpr size_t bits = 48;
+        };
+    };
+    struct L2 {
+        static constexpr size_t size = 1_MB;
+        static constexpr size_t ways = 16;
+        static constexpr size_t way_size = size / ways;
+    };
+};
+
+template<typename _T, typename _L>
+struct PageColors {
+    using T = IDE_DEFAULT_TYPE(_T, M1);
+    using L = IDE_DEFAULT_TYPE(_L, T::L2);
+    using M = T::Memory;
+    static constexpr size_t colors = L::way_size / T::Memory::Page::size;
+    static constexpr size_t bits = log2(colors);
+    // https://dinhtta.github.io/cache/
+    // m (tag bits) + s (set bits) + b (line offset bits)
+    // s = c (color bits) + i (uncolored)
+    static constexpr size_t b_bits = M::CacheLine::bits;
+    static constexpr size_t i_bits = M::Page::bits - b_bits;
+    static constexpr size_t c_bits = bits;
+    constexpr static uint64_t make_mask(uint64_t) {
+        return (1ul << bits) - 1;
+    }
+    constexpr static uint64_t extract_bits(uint64_t v, size_t n, size_t c) {
+        return (v >> n) & make_mask(c);
+    }
+    constexpr static size_t get_page_color(void *p) {
+        return extract_bits(uint64_t(p), b_bits + i_bits, c_bits);
+    }
+    constexpr static size_t get_colors_cnt() {
+        return 1ul << c_bits;
+    }
+};
+
+using PageColors_M1L2 = PageColors<M1,M1::L2>;
+static_assert(PageColors_M1L2::b_bits == 7);
+static_assert(PageColors_M1L2::i_bits == 7);
+static_assert(PageColors_M1L2::c_bits == 6);
+
+#if IS_ARM
+using HostCacheModel = M1;
+#else
+using HostCacheModel = Skylake;
+#endif
@@ -0,0 +1,391 @@
+#pragma once
+
+#include <compiling.h>
+#include <hw_cache.hpp>
+#include <resources.hpp>
+#include <algorithm> // IWYU keep
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <map>
+
+/*
+ ONLINE PAGE RECOLORING
+ - hot pages are sampled each sample interval by the first sampler the kernel supports, heat decays by half
+   each sample, a sample is spread over step() calls, sample_pages per call
+   - soft dirty: cleared via /proc/self/clear_refs, read back from pagemap, only written pages count as hot
+     (CONFIG_MEM_SOFT_DIRTY)
+   - idle page: PFNs are marked idle in /sys/kernel/mm/page_idle/bitmap, any access clears the bit
+     (CONFIG_IDLE_PAGE_TRACKING, root)
+   - hint: application reports accessed pages itself with hint()
+ - color is oversubscribed when it has more hot pages than L2 ways
+ - excess hot pages of such colors are copied into spare pages of the least loaded colors and the spare page
+   is moved over the original virtual address with mremap, original physical page is released
+ - migrations are queued and done in batches from step(), which the serving thread calls between requests,
+   so copying never races with the application writing the page and pause per call is bounded by either
+   a batch or sample_pages
+ - every moved page is a VMA of its own which the kernel can't merge with neighbors, a migration splits up to
+   three VMAs (base before and after the page, hole in spare region), so migrations stop once they would use
+   vma_share of map count left below vm.max_map_count at allocation, mremap failing would be fatal
+ - sampling refreshes PFNs of base pages and a spare page is re-read before use, compaction, NUMA balancing
+   or KSM may move pages after allocation
+ */
+
+template<typename _T>
+struct PageRecoloring {
+    using T = IDE_DEFAULT_TYPE(_T, M1);
+    using M = T::Memory;
+    using C = PageColors<T, typename T::L2>;
+    using L = T::L2;
+    using vaddr_t = uint8_t*;
+    using page_indices_t = std::vector<size_t>;
+    using cmap_t = std::vector<page_indices_t>;
+    using clock = std::chrono::steady_clock;
+    constexpr static size_t straddle = M::Page::size / PAGE_SIZE;
+    static_assert(M::Page::size % PAGE_SIZE == 0);
+
+    struct Config {
+        size_t batch_pages = 4;                                 // migrations per batch
+        clock::duration batch_interval = std::chrono::milliseconds(1);  // min time between batches
+        clock::duration sample_interval = std::chrono::milliseconds(10);
+        uint8_t hot_heat = 0x40;                                // accessed within last two samples
+        size_t sample_pages = 512;                              // pages sampled per step() call
+        double vma_share = 0.5;                                 // of free map count migrations may use
+    };
+    constexpr static size_t vmas_per_migration = 3;
+    static constexpr const char *max_map_count = "/proc/sys/vm/max_map_count";
+
+    enum class Sampler {
+        soft_dirty, idle_page, hint
+    };
+    static constexpr const char *idle_bitmap = "/sys/kernel/mm/page_idle/bitmap";
+
+    struct Migration {
+        size_t page;
+        size_t color;
+    };
+
+    Config config;
+    Sampler sampler = Sampler::hint;
+    using idle_words_t = std::map<uint64_t, uint64_t>;          // idle bitmap word index to word
+    constexpr static size_t idle_gap_words = 8;                 // gap read along rather than split a range
+    int idle_fd = -1;
+    vaddr_t base = nullptr, spare_base = nullptr;
+    size_t population = 0, spare_population = 0;
+    std::vector<PageMapEntry> base_map, spare_map;
+    std::vector<uint8_t> heat;
+    std::vector<uint8_t> hints;     // pages accessed since last sample, reported by application
+    cmap_t spares;              // map of color to unused spare pages indices
+    std::deque<Migration> pending;
+    clock::time_point last_sample, last_batch;
+    size_t migrated = 0, samples = 0;
+    size_t max_migrations = 0;      // VMA budget, see header
+    size_t sampled = 0;             // pages of the current sample done, population once it is complete
+
+    PageRecoloring() = default;
+    PageRecoloring(const PageRecoloring&) = delete;
+    PageRecoloring& operator=(const PageRecoloring&) = delete;
+    ~PageRecoloring() {
+        if (idle_fd >= 0)
+            SYS_CALL(close(idle_fd), "close");
+    }
+
+    static vaddr_t mmap_aligned(size_t pages) {
+        void *raw;
+        // no MAP_POPULATE, with THP enabled=always populated range is already made of huge pages
+        SYS_CALL_MMAP(raw = mmap(0, M::Page::size * (pages + 1), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0), "mmap");
+        vaddr_t aligned = (vaddr_t) align_up(raw, M::Page::size);
+        // mremap of a single page would split transparent huge page anyway
+        SYS_CALL(madvise(aligned, M::Page::size * pages, MADV_NOHUGEPAGE), "madvise");
+        memset(aligned, 0, M::Page::size * pages); // faults pages in only after madvise
+        return aligned;
+    }
+
+    // managed region of given pages plus spare pages recoloring takes replacements from
+    vaddr_t allocate(size_t pages, size_t spare_pages) {
+        population = pages;
+        spare_population = spare_pages;
+        base = mmap_aligned(population);
+        spare_base = mmap_aligned(spare_population);
+        base_map.resize(population);
+        spare_map.resize(spare_population);
+        get_physical_pages(base, &base_map[0], population, straddle);
+        get_physical_pages(spare_base, &spare_map[0], spare_population, straddle);
+        CHECK(base_map[0].ptr(), "no PFN in pagemap, it requires CAP_SYS_ADMIN");
+        heat.assign(population, 0);
+        hints.assign(population, 0);
+        spares.resize(C::get_colors_cnt());
+        for (size_t i = 0; i < spare_population; ++i)
+            spares[color_of(spare_map[i])].push_back(i);
+        detect_sampler();
+        budget_migrations();
+        reset_sampling(0, base_map);
+        sampled = population;
+        last_sample = last_batch = clock::now();
+        return base;
+    }
+
+    void budget_migrations() {
+        size_t limit = 0, maps = 0;
+        std::ifstream { max_map_count } >> limit;
+        std::ifstream maps_file { "/proc/self/maps" };
+        for (std::string line; getline(maps_file, line);)
+            ++maps;
+        CHECK(limit > maps, max_map_count << ' ' << limit << " maps " << maps);
+        max_migrations = size_t(config.vma_share * (limit - maps)) / vmas_per_migration;
+    }
+
+    static bool present(const PageMapEntry &e) {
+        return (uint64_t(e.entry) & PageMapEntry::present) && e.ptr();
+    }
+
+    static size_t color_of(const PageMapEntry &e) {
+        return C::get_page_color(e.ptr());
+    }
+    size_t color(size_t idx) const {
+        return color_of(base_map[idx]);
+    }
+    vaddr_t page(size_t idx) const {
+        return base + M::Page::size * idx;
+    }
+    vaddr_t spare_page(size_t idx) const {
+        return spare_base + M::Page::size * idx;
+    }
+    bool hot(size_t idx) const {
+        return heat[idx] >= config.hot_heat;
+    }
+
+    static const char* sampler_name(Sampler s) {
+        switch (s) {
+        case Sampler::soft_dirty:
+            return "soft_dirty";
+        case Sampler::idle_page:
+            return "idle_page";
+        case Sampler::hint:
+            return "hint";
+        }
+        return "unknown";
+    }
+
+    void detect_sampler() {
+        // pagemap reports soft dirty bit as zero without CONFIG_MEM_SOFT_DIRTY
+        clear_soft_dirty();
+        mem_store(base, mem_load(base));
+        PageMapEntry e;
+        get_physical_pages(base, &e, 1);
+        if (uint64_t(e.entry) & PageMapEntry::soft_dirty)
+            sampler = Sampler::soft_dirty;
+        else if ((idle_fd = open(idle_bitmap, O_RDWR)) >= 0)
+            sampler = Sampler::idle_page;
+        else
+            sampler = Sampler::hint;
+        std::cout << "recoloring sampler " << sampler_name(sampler) << std::endl;
+    }
+
+    static void clear_soft_dirty() {
+        int fd;
+        SYS_CALL(fd = open("/proc/self/clear_refs", O_WRONLY), "open");
+        SYS_CALL(write(fd, "4", 1), "write");
+        SYS_CALL(close(fd), "close");
+    }
+
+    static uint64_t pfn(const PageMapEntry &e) {
+        return uint64_t(e.entry) & PageMapEntry::pfn_mask;
+    }
+
+    // idle bitmap has one bit per PFN, reading 1 means the page was not accessed since it was marked idle,
+    // words of given pages are read with one pread per range of close words
+    idle_words_t read_idle_words(const std::vector<PageMapEntry> &entries) const {
+        idle_words_t words;
+        for (auto &e : entries)
+            words[pfn(e) / 64] = 0;
+        for_idle_ranges(words, [&](uint64_t first, uint64_t *range, size_t cnt) {
+            ssize_t bytes = cnt * sizeof(uint64_t);
+            SYS_CALL_CHECK(pread(idle_fd, range, bytes, first * sizeof(uint64_t)) != bytes, "pread");
+        });
+        return words;
+    }
+
+    // writing 1 marks the page idle, 0 bits are ignored, so gaps are written as zeros
+    void mark_idle(const std::vector<PageMapEntry> &entries) {
+        idle_words_t words;
+        for (auto &e : entries)
+            words[pfn(e) / 64] |= 1ul << (pfn(e) % 64);
+        for_idle_ranges(words, [&](uint64_t first, uint64_t *range, size_t cnt) {
+            ssize_t bytes = cnt * sizeof(uint64_t);
+            SYS_CALL_CHECK(pwrite(idle_fd, range, bytes, first * sizeof(uint64_t)) != bytes, "pwrite");
+        });
+    }
+
+    // calls f(first word, words, count) for every range of close words, read back into the map after f
+    template<typename F>
+    static void for_idle_ranges(idle_words_t &words, F f) {
+        std::vector<uint64_t> range;
+        for (auto it = words.begin(); it != words.end();) {
+            uint64_t first = it->first;
+            auto last = it;
+            for (auto n = std::next(it); n != words.end() && n->first - last->first <= idle_gap_words; ++n)
+                last = n;
+            range.assign(last->first - first + 1, 0);
+            for (auto w = it; w != std::next(last); ++w)
+                range[w->first - first] = w->second;
+            f(first, &range[0], range.size());
+            for (++last; it != last; ++it)
+                it->second = range[it->first - first];
+        }
+    }
+
+    void hint(size_t idx) {
+        hints[idx] = 1;
+    }
+
+    bool accessed(size_t idx, const PageMapEntry &e, const idle_words_t &idle) const {
+        switch (sampler) {
+        case Sampler::soft_dirty:
+            return uint64_t(e.entry) & PageMapEntry::soft_dirty;
+        case Sampler::idle_page:
+            return !(idle.at(pfn(e) / 64) & (1ul << (pfn(e) % 64)));
+        case Sampler::hint:
+            return hints[idx];
+        }
+        return false;
+    }
+
+    // entries of pages from first on, soft dirty bits are cleared for the whole process once a sample completes
+    void reset_sampling(size_t first, const std::vector<PageMapEntry> &entries) {
+        switch (sampler) {
+        case Sampler::soft_dirty:
+            if (first + entries.size() == population)
+                clear_soft_dirty();
+            break;
+        case Sampler::idle_page:
+            mark_idle(entries);
+            break;
+        case Sampler::hint:
+            std::fill(hints.begin() + first, hints.begin() + first + entries.size(), 0);
+            break;
+        }
+    }
+
+    // samples next sample_pages pages, returns true once the sample is complete
+    bool sample() {
+        size_t first = sampled, cnt = std::min(config.sample_pages, population - sampled);
+        std::vector<PageMapEntry> entries(cnt);
+        get_physical_pages(page(first), &entries[0], cnt, straddle);
+        idle_words_t idle;
+        if (sampler == Sampler::idle_page)
+            idle = read_idle_words(entries);
+        for (size_t i = 0; i < cnt; ++i) {
+            heat[first + i] = (heat[first + i] >> 1) | (accessed(first + i, entries[i], idle) ? 0x80 : 0);
+            if (present(entries[i]))
+                base_map[first + i] = entries[i];
+        }
+        reset_sampling(first, entries);
+        sampled += cnt;
+        samples += sampled == population;
+        return sampled == population;
+    }
+
+    std::vector<size_t> hot_per_color() const {
+        std::vector<size_t> hot_cnt(C::get_colors_cnt());
+        for (size_t i = 0; i < population; ++i)
+            hot_cnt[color(i)] += hot(i);
+        return hot_cnt;
+    }
+
+    size_t oversubscribed_colors() const {
+        auto hot_cnt = hot_per_color();
+        return std::count_if(hot_cnt.begin(), hot_cnt.end(), [](size_t cnt) {
+            return cnt > L::ways;
+        });
+    }
+
+    // moves excess hot pages of oversubscribed colors to least loaded colors which still have spare pages
+    void plan() {
+        auto hot_cnt = hot_per_color();
+        std::vector<size_t> available(C::get_colors_cnt());
+        for (size_t c = 0; c < available.size(); ++c)
+            available[c] = spares[c].size();
+        for (size_t i = 0; i < population && migrated + pending.size() < max_migrations; ++i) {
+            size_t from = color(i);
+            if (!hot(i) || hot_cnt[from] <= L::ways)
+                continue;
+            size_t to = from;
+            for (size_t c = 0; c < hot_cnt.size(); ++c)
+                if (available[c] && hot_cnt[c] < L::ways && (to == from || hot_cnt[c] < hot_cnt[to]))
+                    to = c;
+            if (to == from)
+                break; // every color is full
+            --hot_cnt[from];
+            ++hot_cnt[to];
+            --available[to];
+            pending.push_back( { i, to });
+        }
+    }
+
+    // spare page of the color, its PFN is re-read and pages found moved to other colors are re-indexed
+    bool take_spare(size_t color, size_t &s) {
+        while (!spares[color].empty()) {
+            s = spares[color].back();
+            spares[color].pop_back();
+            get_physical_pages(spare_page(s), &spare_map[s], 1, straddle);
+            if (!present(spare_map[s]))
+                continue; // swapped out, dropped
+            if (color_of(spare_map[s]) == color)
+                return true;
+            spares[color_of(spare_map[s])].push_back(s);
+        }
+        return false;
+    }
+
+    // false if no spare page of the color is left
+    bool migrate(const Migration &m) {
+        size_t s;
+        if (!take_spare(m.color, s))
+            return false;
+        vaddr_t vaddr, src = page(m.page), dst = spare_page(s);
+        memcpy(dst, src, M::Page::size);
+        const int remap_flags = MREMAP_FIXED | MREMAP_MAYMOVE;
+        SYS_CALL_MMAP(vaddr = (vaddr_t ) mremap(dst, M::Page::size, M::Page::size, remap_flags, src), "mremap");
+        SYS_CALL_CHECK(vaddr != src, "mremap");
+        base_map[m.page] = spare_map[s];
+        // copy accessed the new page, it is not hot for that
+        if (sampler == Sampler::idle_page)
+            mark_idle( { base_map[m.page] });
+        ++migrated;
+        return true;
+    }
+
+    // to be called periodically from the serving thread, returns pages migrated by this call
+    size_t step() {
+        auto now = clock::now();
+        if (!pending.empty()) {
+            if (now - last_batch < config.batch_interval)
+                return 0;
+            size_t batch = std::min(config.batch_pages, pending.size()), done = 0;
+            for (size_t i = 0; i < batch; ++i) {
+                done += migrate(pending.front());
+                pending.pop_front();
+            }
+            last_batch = now;
+            return done;
+        }
+        if (sampled == population && now - last_sample >= config.sample_interval) {
+            sampled = 0;
+            last_sample = now;
+        }
+        if (sampled < population && sample())
+            plan();
+        return 0;
+    }
+
+    void dump_hot_colors() const {
+        auto hot_cnt = hot_per_color();
+        std::cout << "samples " << samples << " migrated " << migrated << '/' << max_migrations << " pending "
+                << pending.size() << " hot by color";
+        for (size_t c = 0; c < hot_cnt.size(); ++c)
+            std::cout << ' ' << hot_cnt[c] << (hot_cnt[c] > L::ways ? "!" : "");
+        std::cout << std::endl;
+    }
+};
@@ -72,7 +72,7 @@ inline
 void get_physical_pages(void *addr, PageMapEntry *buffer, size_t pages, size_t stride = 1) {
     int fd;
     assert(PAGE_SIZE == getpagesize());
-    SYS_CALL(fd = open("/proc/self/pagemap", O_RDWR), "open");
+    SYS_CALL(fd = open("/proc/self/pagemap", O_RDONLY), "open");
     if (stride == 1) {
         SYS_CALL(pread(fd, buffer, sizeof(PageMapEntry) * pages, size_t(addr)/PAGE_SIZE * sizeof(PageMapEntry)), "pread");
     } else {